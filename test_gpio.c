@@ -2,6 +2,7 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/of_device.h>
+#include <linux/of.h>
 #include <linux/delay.h>
 #include <linux/string.h>
 #include <linux/io.h>
@@ -11,6 +12,18 @@
 #include <linux/slab.h>
 #include <linux/sysfs.h>
 #include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+
+#include "test_gpio.h"
 
 
 #define NUM_GPIOS 54
@@ -20,6 +33,30 @@ static int gpio[NUM_GPIOS];
 static int gpio_argc = 0;
 module_param_array(gpio, int, &gpio_argc, 0644);
 
+/* Parallel port: ordered list of data pins (par_pins[0] is bit 0 of the word) and optional strobe pin.
+ * The port is set up once at probe, so these are read-only. */
+#define PAR_MAX_BITS	16
+static int par_pins[PAR_MAX_BITS];
+static int par_argc = 0;
+module_param_array(par_pins, int, &par_argc, 0444);
+static int par_strobe = -1;
+module_param(par_strobe, int, 0444);
+/* 0 - word is latched on the rising edge of the strobe, strobe idles high
+ * 1 - word is latched on the falling edge of the strobe, strobe idles low (e.g. E of HD44780 LCD,
+ *     which also needs par_setup_ns, par_pulse_ns and par_gap_us below) */
+static int par_strobe_falling = 0;
+module_param(par_strobe_falling, int, 0444);
+/* Timing of the port, all zero by default for latches fast enough to follow back to back writes:
+ * par_setup_ns - data setup time, from the data pins set to the start of the strobe pulse
+ * par_pulse_ns - width of the strobe pulse
+ * par_gap_us   - time between two words, e.g. execution time of an LCD command */
+static unsigned int par_setup_ns = 0;
+module_param(par_setup_ns, uint, 0444);
+static unsigned int par_pulse_ns = 0;
+module_param(par_pulse_ns, uint, 0444);
+static unsigned int par_gap_us = 0;
+module_param(par_gap_us, uint, 0444);
+
 
 /* GPIO Function Select Registers
  *
@@ -103,6 +140,89 @@ module_param_array(gpio, int, &gpio_argc, 0644);
 #define GET_GPFEN_PIN_OFFSET(pin)		(pin)
 
 
+/* GPIO High Detect Enable Registers
+ *
+ * 2 GPHEN 32-bit registers, starting from offset 0x64
+ * Every register controls 32 pins, 1 bit per pin:
+ * 0 - High detect disabled
+ * 1 - High level on pin sets corresponding bit in GPEDS */
+#define GPHEN		0x64
+#define GET_GPHEN_REG_OFFSET(pin)		(GPHEN + (((pin) / 32) * 4))
+#define GET_GPHEN_PIN_OFFSET(pin)		(pin)
+
+
+/* GPIO Low Detect Enable Registers
+ *
+ * 2 GPLEN 32-bit registers, starting from offset 0x70
+ * Every register controls 32 pins, 1 bit per pin:
+ * 0 - Low detect disabled
+ * 1 - Low level on pin sets corresponding bit in GPEDS */
+#define GPLEN		0x70
+#define GET_GPLEN_REG_OFFSET(pin)		(GPLEN + (((pin) / 32) * 4))
+#define GET_GPLEN_PIN_OFFSET(pin)		(pin)
+
+
+/* GPIO Asynchronous rising Edge Detect Enable Registers
+ *
+ * 2 GPAREN 32-bit registers, starting from offset 0x7C
+ * Every register controls 32 pins, 1 bit per pin.
+ * Unlike GPREN, the edge is not sampled by the system clock, so very short pulses are detected too:
+ * 0 - Asynchronous rising edge detect disabled
+ * 1 - Asynchronous rising edge sets corresponding bit in GPEDS */
+#define GPAREN		0x7C
+#define GET_GPAREN_REG_OFFSET(pin)		(GPAREN + (((pin) / 32) * 4))
+#define GET_GPAREN_PIN_OFFSET(pin)		(pin)
+
+
+/* GPIO Asynchronous falling Edge Detect Enable Registers
+ *
+ * 2 GPAFEN 32-bit registers, starting from offset 0x88
+ * Every register controls 32 pins, 1 bit per pin:
+ * 0 - Asynchronous falling edge detect disabled
+ * 1 - Asynchronous falling edge sets corresponding bit in GPEDS */
+#define GPAFEN		0x88
+#define GET_GPAFEN_REG_OFFSET(pin)		(GPAFEN + (((pin) / 32) * 4))
+#define GET_GPAFEN_PIN_OFFSET(pin)		(pin)
+
+
+/* GPIO Pull-up/down Register
+ *
+ * GPPUD 32-bit register at offset 0x94, bits 1-0 select the pull state (enum pull)
+ * which is clocked into the pins selected in GPPUDCLK. */
+#define GPPUD		0x94
+
+
+/* GPIO Pull-up/down Clock Registers
+ *
+ * 2 GPPUDCLK 32-bit registers, starting from offset 0x98.
+ * Every register controls 32 pins, 1 bit per pin:
+ * 0 - no effect
+ * 1 - Assert clock on GPIO pin, the pin takes the pull state from GPPUD
+ * The last register ends at 0xa0, which is the size of the reg range in test_gpio-overlay.dts */
+#define GPPUDCLK	0x98
+#define GET_GPPUDCLK_REG_OFFSET(pin)	(GPPUDCLK + (((pin) / 32) * 4))
+#define GET_GPPUDCLK_PIN_OFFSET(pin)	((pin) % 32)
+
+/* System Timer Counter Registers
+ *
+ * Optional second reg range of the test_gpio node is the BCM2835 system timer (bus address 0x7e003000).
+ * CLO and CHI are the lower and higher 32 bits of the free-running 64-bit counter,
+ * which is incremented at 1 MHz. */
+#define ST_CLO		0x04
+#define ST_CHI		0x08
+
+/* Correlation of the system timer to CLOCK_MONOTONIC is refreshed every STC_CORR_PERIOD_MS */
+#define STC_CORR_PERIOD_MS	1000
+/* Number of samples for the correlation, the one with the shortest window is taken */
+#define STC_CORR_SAMPLES	3
+
+/* Size of the event queue, must be a power of 2 */
+#define EVENT_QUEUE_SIZE	64
+
+/* bits of pins 54-63 in the second bank registers do not exist */
+#define BANK1_PINS_MASK		((1U << (NUM_GPIOS - 32)) - 1)
+
+
 
 enum output_level {
 	OUTPUT_LOW,
@@ -121,27 +241,121 @@ enum reg_fsel {
 	REG_FSEL_ALT5 = 2
 };
 
+enum pull {
+	PULL_OFF = 0,
+	PULL_DOWN = 1,
+	PULL_UP = 2
+};
+
 enum edge_detect {
 	EDGE_RISING,
-	EGDE_FALLING
+	EGDE_FALLING,
+	EDGE_ASYNC_RISING,
+	EDGE_ASYNC_FALLING,
+	LEVEL_HIGH,
+	LEVEL_LOW,
+	EDGE_MAX
 };
 
+/* Detect enable register of every enum edge_detect mode */
+static const int edge_reg[EDGE_MAX] = {
+	[EDGE_RISING]		= GPREN,
+	[EGDE_FALLING]		= GPFEN,
+	[EDGE_ASYNC_RISING]	= GPAREN,
+	[EDGE_ASYNC_FALLING]	= GPAFEN,
+	[LEVEL_HIGH]		= GPHEN,
+	[LEVEL_LOW]		= GPLEN,
+};
+
+/* Register images of the initial pin configuration from the device tree.
+ * Every register is written once, registers shared with other pins are read-modify-written
+ * using the mask of the configured pins. */
+struct test_gpio_image {
+	unsigned int fsel[6];
+	unsigned int fsel_mask[6];
+	unsigned int set[2];
+	unsigned int clr[2];
+	unsigned int detect[EDGE_MAX][2];
+	unsigned int detect_mask[2];		/* pins which have "edge" property */
+	unsigned int pull[PULL_UP + 1][2];	/* indexed by enum pull */
+};
+
+
+/* Number of bytes copied from userspace at once by the parallel port write() */
+#define PAR_CHUNK	256
+
+struct test_gpio_dev;
+
+/* Parallel port: every word written to its misc device is scattered over the data pins.
+ * set[byte][value][bank] is the GPSET mask for the given byte lane of the word,
+ * the GPCLR mask is the rest of the data pins in the same bank. */
+struct test_gpio_par {
+	struct miscdevice miscdev;
+	struct test_gpio_dev *gpioDev;
+	struct mutex lock;
+	int width;			/* bytes per word: 1 for up to 8 pins, 2 for up to 16 pins */
+	unsigned int mask[2];		/* all data pins, per bank */
+	unsigned int strobe;		/* strobe pin bit in its bank (zero if no strobe) */
+	int strobe_pulse;		/* GPSET/GPCLR register of the strobe bank, which leaves the idle level */
+	int strobe_idle;		/* GPSET/GPCLR register of the strobe bank, which returns to the idle level */
+	unsigned int setup_ns;		/* timing, from the module parameters at probe */
+	unsigned int pulse_ns;
+	unsigned int gap_us;
+	unsigned int set[PAR_MAX_BITS / 8][256][2];
+};
 
 struct test_gpio_dev {
 	struct miscdevice miscdev;
 	void __iomem *regs;
 	struct device_attribute **dev_attr;
 	char **sysfiles;
+	int num_sysfiles;
 	int irq;
+	struct test_gpio_par *par;
+	/* GPPUD/GPPUDCLK sequence must not be interleaved */
+	struct mutex pull_lock;
+	struct device *dev;
+	/* sysfs file name of every pin which has one, NULL otherwise */
+	char *pin_sysfile[NUM_GPIOS];
+	/* Detect enable registers are read-modify-written from the interrupt too */
+	spinlock_t detect_lock;
+	/* Level detect pins masked by the interrupt, until their value is read (see acknowledge_int) */
+	unsigned int level_masked[2][2];	/* [0] high, [1] low, per bank */
+	/* Events from the interrupt, taken by TEST_GPIO_IOC_GET_EVENT */
+	DECLARE_KFIFO(events, struct test_gpio_event, EVENT_QUEUE_SIZE);
+	struct mutex event_lock;		/* serializes readers of the queue */
+	wait_queue_head_t event_wait;		/* woken up when an event is queued */
+	bool events_lost;
+	/* System timer, NULL if it is not in the device tree */
+	void __iomem *stc;
+	struct test_gpio_stc_corr stc_corr;
+	struct mutex stc_lock;			/* protects stc_corr */
+	struct delayed_work stc_work;
+	/* sysfs_notify() may sleep, so interrupt only marks the pin and the work notifies pollers */
+	DECLARE_BITMAP(notify_pending, NUM_GPIOS);
+	struct work_struct notify_work;
 };
 
 static ssize_t test_gpio_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos);
 static ssize_t test_gpio_read(struct file *file, char __user *buf, size_t count, loff_t * ppos);
+static long test_gpio_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static unsigned int test_gpio_poll(struct file *file, poll_table *wait);
+static ssize_t test_gpio_par_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos);
+static void apply_image(struct test_gpio_dev *gpioDev, struct test_gpio_image *img);
 
 static const struct file_operations test_gpio_fops = {
     .owner      = THIS_MODULE,
     .write      = test_gpio_write,
-	.read       = test_gpio_read
+	.read       = test_gpio_read,
+	.unlocked_ioctl = test_gpio_ioctl,
+	/* structs in test_gpio.h have the same layout for 32-bit userspace */
+	.compat_ioctl = test_gpio_ioctl,
+	.poll       = test_gpio_poll
+};
+
+static const struct file_operations test_gpio_par_fops = {
+	.owner      = THIS_MODULE,
+	.write      = test_gpio_par_write
 };
 
 static unsigned int reg_read(struct test_gpio_dev *gpioDev, int off)
@@ -169,7 +383,7 @@ static int set_output(struct test_gpio_dev *gpioDev, char pin, enum output_level
 	pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
 	/* set pin as output */
 	// first, cleanup all 3 pin bits
-	mask = (0x03 << pin_offset);
+	mask = (0x07 << pin_offset);
 	val = reg_read(gpioDev, reg_offset) & ~mask;
 	// then set pin as output
 	mask = (0x01 << pin_offset);
@@ -209,7 +423,7 @@ static int set_input(struct test_gpio_dev *gpioDev, char pin) {
 
 	reg_offset = GET_GPFSEL_REG_OFFSET(pin);
 	pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
-	mask = (0x03 << pin_offset);
+	mask = (0x07 << pin_offset);
 	val = reg_read(gpioDev, reg_offset) & ~mask;
 	reg_write(gpioDev, val, reg_offset);
 
@@ -217,101 +431,167 @@ static int set_input(struct test_gpio_dev *gpioDev, char pin) {
 }
 
 
+/* Set pull state of all pins in mask0 (pins 0-31) and mask1 (pins 32-53) with one sequence:
+ * 1) write pull state to GPPUD
+ * 2) wait 150 cycles, which is the set-up time for the control signal
+ * 3) write GPPUDCLK0/1 to clock the state into the pins
+ * 4) wait 150 cycles, which is the hold time for the control signal
+ * 5) remove the control signal and the clock */
+static int set_pull_mask(struct test_gpio_dev *gpioDev, unsigned int mask0, unsigned int mask1, enum pull pull) {
+
+	if (mask0 == 0 && mask1 == 0)
+		return 0;
+
+	mutex_lock(&gpioDev->pull_lock);
+
+	reg_write(gpioDev, pull, GPPUD);
+	// 150 cycles of the 250 MHz core clock is well below 1us
+	udelay(1);
+	reg_write(gpioDev, mask0, GPPUDCLK);
+	reg_write(gpioDev, mask1, GPPUDCLK + 4);
+	udelay(1);
+	reg_write(gpioDev, PULL_OFF, GPPUD);
+	reg_write(gpioDev, 0, GPPUDCLK);
+	reg_write(gpioDev, 0, GPPUDCLK + 4);
+
+	mutex_unlock(&gpioDev->pull_lock);
+
+	return 0;
+}
+
+static int set_pull(struct test_gpio_dev *gpioDev, char pin, enum pull pull) {
+	unsigned int mask[2] = {0, 0};
+
+	if ((unsigned char)pin >= NUM_GPIOS)
+		return -EINVAL;
+
+	mask[pin / 32] = (0x1U << GET_GPPUDCLK_PIN_OFFSET(pin));
+
+	return set_pull_mask(gpioDev, mask[0], mask[1], pull);
+}
+
 static int disable_egdes(struct test_gpio_dev *gpioDev, char pin) {
-	int val, mask;
-	int reg_offset, pin_offset;
+	unsigned int val, mask;
+	int reg_offset, e;
+	unsigned long flags;
 
-	// Disable Rissing edge
-	reg_offset = GET_GPREN_REG_OFFSET(pin);
-	pin_offset = GET_GPREN_PIN_OFFSET(pin);
+	if ((unsigned char)pin >= NUM_GPIOS)
+		return -EINVAL;
 
-	/* Read register value */
-	val = reg_read(gpioDev, reg_offset);
-	// clear pin in corresponding Rising register
-	mask = (0x01 << pin_offset);
-	val &= ~mask;
-	reg_write(gpioDev, val, reg_offset);
+	mask = (0x01U << (pin % 32));
 
+	spin_lock_irqsave(&gpioDev->detect_lock, flags);
 
-	// Disable Falling edge
-	reg_offset = GET_GPFEN_REG_OFFSET(pin);
-	pin_offset = GET_GPFEN_PIN_OFFSET(pin);
+	// Disable all edge and level detect modes
+	for (e = 0; e < EDGE_MAX; e++) {
+		reg_offset = edge_reg[e] + ((pin / 32) * 4);
 
-	/* Read register value */
-	val = reg_read(gpioDev, reg_offset);
-	// clear pin in corresponding Falling register
-	mask = (0x01 << pin_offset);
-	val &= ~mask;
-	reg_write(gpioDev, val, reg_offset);
+		/* Read register value */
+		val = reg_read(gpioDev, reg_offset);
+		// clear pin in corresponding detect register
+		val &= ~mask;
+		reg_write(gpioDev, val, reg_offset);
+	}
+	gpioDev->level_masked[0][pin / 32] &= ~mask;
+	gpioDev->level_masked[1][pin / 32] &= ~mask;
+
+	spin_unlock_irqrestore(&gpioDev->detect_lock, flags);
 
 	return 0;
 }
 
 static int enable_egde(struct test_gpio_dev *gpioDev, char pin, int edge) {
-	int val, mask;
-	int reg_offset, pin_offset;
+	unsigned int val, mask;
+	int reg_offset;
+	unsigned long flags;
+
+	if ((unsigned char)pin >= NUM_GPIOS || edge < 0 || edge >= EDGE_MAX) {
+		printk(KERN_ALERT "\n[%s][%d] ERROR: Invalid argument!\n", __FUNCTION__, __LINE__);
+		return -EINVAL;
+	}
 
 	disable_egdes(gpioDev, pin);
 	set_input(gpioDev, pin);
 
-	switch (edge) {
-	case EDGE_RISING:
-		reg_offset = GET_GPREN_REG_OFFSET(pin);
-		pin_offset = GET_GPREN_PIN_OFFSET(pin);
-		break;
-
-	case EGDE_FALLING:
-		reg_offset = GET_GPFEN_REG_OFFSET(pin);
-		pin_offset = GET_GPFEN_PIN_OFFSET(pin);
-		break;
-
-	default:
-		printk(KERN_ALERT "\n[%s][%d] ERROR: Invalid argument!\n", __FUNCTION__, __LINE__);
-		//TODO: Handle this error
-	}
+	reg_offset = edge_reg[edge] + ((pin / 32) * 4);
 
+	spin_lock_irqsave(&gpioDev->detect_lock, flags);
 	/* Read register value */
 	val = reg_read(gpioDev, reg_offset);
-	// Set pin in corresponding Rising/Falling register
-	mask = (0x01 << pin_offset);
+	// Set pin in corresponding detect register
+	mask = (0x01U << (pin % 32));
 	val |= mask;
 	reg_write(gpioDev, val, reg_offset);
+	spin_unlock_irqrestore(&gpioDev->detect_lock, flags);
 
 	return 0;
 }
 
-static int acknowledge_int(struct test_gpio_dev *gpioDev) {
-	int val, orig_val, mask;
-	int reg_offset = GPEDS;
-	int pin = 0, i;
+/* Re-enable level detect of the pin, if it was masked by acknowledge_int() */
+static int rearm_level(struct test_gpio_dev *gpioDev, char pin) {
+	unsigned int val, mask;
+	int reg_offset, i;
+	unsigned long flags;
 
-	/* Read register value */
-	val = reg_read(gpioDev, reg_offset);
-//	pr_info("\n     val 1: 0x%x\n", val);
-	orig_val = val;
-	if (val == 0) {
-		reg_offset += 0x04;
+	if ((unsigned char)pin >= NUM_GPIOS)
+		return -EINVAL;
+
+	mask = (0x01U << (pin % 32));
+
+	spin_lock_irqsave(&gpioDev->detect_lock, flags);
+	for (i = 0; i < 2; i++) {
+		if (!(gpioDev->level_masked[i][pin / 32] & mask))
+			continue;
+		gpioDev->level_masked[i][pin / 32] &= ~mask;
+		reg_offset = (i == 0 ? GET_GPHEN_REG_OFFSET(pin) : GET_GPLEN_REG_OFFSET(pin));
 		val = reg_read(gpioDev, reg_offset);
-		//pr_info("\n     val 2: 0x%x\n", val);
-		pin += 32;
+		reg_write(gpioDev, val | mask, reg_offset);
 	}
+	spin_unlock_irqrestore(&gpioDev->detect_lock, flags);
 
-	for (i = 0; i < 32; i++) {
-		if (i != 0)
-		   val >>= 1;
-		if (val == 1)
-			break;
+	return 0;
+}
+
+/* Acknowledge events of all pending pins at once, pending pins are returned in pending[].
+ * Level detect keeps setting the event bit as long as the level is present, so before
+ * the event is cleared, level detect of the pin is masked. It is re-armed when the value of
+ * the pin is read through sysfs, its event is taken with TEST_GPIO_IOC_GET_EVENT,
+ * or its detect mode is set again.
+ * Returns 0 if no event is pending. */
+static int acknowledge_int(struct test_gpio_dev *gpioDev, unsigned int *pending) {
+	unsigned int val;
+	int bank, level;
+
+	/* Read register values */
+	pending[0] = reg_read(gpioDev, GPEDS);
+	pending[1] = reg_read(gpioDev, GPEDS + 4) & BANK1_PINS_MASK;
+//	pr_info("\n     val 1: 0x%x, val 2: 0x%x\n", pending[0], pending[1]);
+	if (pending[0] == 0 && pending[1] == 0)
+		return 0;
+
+	spin_lock(&gpioDev->detect_lock);
+	for (bank = 0; bank < 2; bank++) {
+		if (pending[bank] == 0)
+			continue;
+		for (level = 0; level < 2; level++) {
+			int level_reg = (level == 0 ? GPHEN : GPLEN) + bank * 4;
+
+			val = reg_read(gpioDev, level_reg);
+			if (val & pending[bank]) {
+				reg_write(gpioDev, val & ~pending[bank], level_reg);
+				gpioDev->level_masked[level][bank] |= (val & pending[bank]);
+			}
+		}
 	}
-	pin += i;
-//	pr_info("\npin: %d\n", pin);
+	spin_unlock(&gpioDev->detect_lock);
 
-	if (pin < 64) {
-		mask = (0x01 << i);
-		orig_val |= mask;
-		reg_write(gpioDev, orig_val, reg_offset);
+	// clear only the events which were read, new ones raise the interrupt again
+	for (bank = 0; bank < 2; bank++) {
+		if (pending[bank])
+			reg_write(gpioDev, pending[bank], GPEDS + bank * 4);
 	}
 
-	return pin;
+	return 1;
 }
 
 
@@ -432,9 +712,30 @@ static ssize_t test_gpio_write(struct file *file, const char __user *buf, size_t
 	else if (strcmp(cmd, "falling") == 0) {
 		enable_egde(gpioDev, pin, EGDE_FALLING);
 	}
+	else if (strcmp(cmd, "async-rising") == 0) {
+		enable_egde(gpioDev, pin, EDGE_ASYNC_RISING);
+	}
+	else if (strcmp(cmd, "async-falling") == 0) {
+		enable_egde(gpioDev, pin, EDGE_ASYNC_FALLING);
+	}
+	else if (strcmp(cmd, "level-high") == 0) {
+		enable_egde(gpioDev, pin, LEVEL_HIGH);
+	}
+	else if (strcmp(cmd, "level-low") == 0) {
+		enable_egde(gpioDev, pin, LEVEL_LOW);
+	}
 	else if (strcmp(cmd, "none") == 0) {
 		disable_egdes(gpioDev, pin);
 	}
+	else if (strcmp(cmd, "pullup") == 0) {
+		set_pull(gpioDev, pin, PULL_UP);
+	}
+	else if (strcmp(cmd, "pulldown") == 0) {
+		set_pull(gpioDev, pin, PULL_DOWN);
+	}
+	else if (strcmp(cmd, "pulloff") == 0) {
+		set_pull(gpioDev, pin, PULL_OFF);
+	}
 	else {
 		printk(KERN_ALERT "\nERROR: Invalid command!\n");
 		err = count;
@@ -448,6 +749,418 @@ out_err:
 	return err;
 }
 
+/******************************************************************************
+ *
+ * System timer timestamps
+ *
+ *****************************************************************************/
+
+/* Read the 64-bit system timer counter, CHI is read again in case CLO wrapped in between */
+static u64 stc_read(struct test_gpio_dev *gpioDev)
+{
+	u32 hi, lo;
+
+	do {
+		hi = readl_relaxed(gpioDev->stc + ST_CHI);
+		lo = readl_relaxed(gpioDev->stc + ST_CLO);
+	} while (hi != readl_relaxed(gpioDev->stc + ST_CHI));
+
+	return ((u64)hi << 32) | lo;
+}
+
+/* Extend the lower 32 bits of the counter latched in the past to 64 bits */
+static u64 stc_extend(struct test_gpio_dev *gpioDev, u32 lo)
+{
+	u64 now = stc_read(gpioDev);
+
+	if (lo > (u32)now)
+		now -= (1ULL << 32);
+
+	return (now & ~0xffffffffULL) | lo;
+}
+
+/* Sample the counter on both sides of ktime_get_ns(). The counter runs at 1 MHz, so CLOCK_MONOTONIC
+ * at the first counter value is the sample minus the half of the window, within the half of the
+ * window plus the counter resolution. */
+static void stc_correlate(struct test_gpio_dev *gpioDev)
+{
+	struct test_gpio_stc_corr corr;
+	unsigned long flags;
+	u32 lo1, lo2, window, best = U32_MAX;
+	u64 mono, best_mono = 0, best_lo = 0;
+	s64 predicted;
+	int i;
+
+	for (i = 0; i < STC_CORR_SAMPLES; i++) {
+		local_irq_save(flags);
+		lo1 = readl_relaxed(gpioDev->stc + ST_CLO);
+		mono = ktime_get_ns();
+		lo2 = readl_relaxed(gpioDev->stc + ST_CLO);
+		local_irq_restore(flags);
+
+		window = lo2 - lo1;
+		if (window < best) {
+			best = window;
+			best_mono = mono;
+			best_lo = lo1;
+		}
+	}
+
+	corr.stc = stc_extend(gpioDev, best_lo);
+	corr.mono_ns = best_mono - (u64)best * (NSEC_PER_USEC / 2) - NSEC_PER_USEC / 2;
+	corr.err_ns = best * (NSEC_PER_USEC / 2) + NSEC_PER_USEC / 2;
+	corr.period_ms = STC_CORR_PERIOD_MS;
+	corr.reserved = 0;
+
+	mutex_lock(&gpioDev->stc_lock);
+	if (gpioDev->stc_corr.period_ms) {
+		predicted = gpioDev->stc_corr.mono_ns + (s64)(corr.stc - gpioDev->stc_corr.stc) * NSEC_PER_USEC;
+		corr.drift_ns = min_t(u64, abs(predicted - (s64)corr.mono_ns), U32_MAX);
+	} else {
+		corr.drift_ns = 0;
+	}
+	gpioDev->stc_corr = corr;
+	mutex_unlock(&gpioDev->stc_lock);
+}
+
+static void test_gpio_stc_work(struct work_struct *work)
+{
+	struct test_gpio_dev *gpioDev = container_of(to_delayed_work(work), struct test_gpio_dev, stc_work);
+
+	stc_correlate(gpioDev);
+	schedule_delayed_work(&gpioDev->stc_work, msecs_to_jiffies(STC_CORR_PERIOD_MS));
+}
+
+/* Convert stc of the event to CLOCK_MONOTONIC with the latest correlation.
+ * The error is the error of the correlation, plus the drift measured over the last period,
+ * scaled to the distance of the event from the correlation point. */
+static void stc_to_mono(struct test_gpio_dev *gpioDev, struct test_gpio_event *event)
+{
+	struct test_gpio_stc_corr *corr = &gpioDev->stc_corr;
+	s64 delta_us;
+	u64 err;
+
+	mutex_lock(&gpioDev->stc_lock);
+	delta_us = (s64)(event->stc - corr->stc);
+	event->stc_ns = corr->mono_ns + delta_us * NSEC_PER_USEC;
+	err = corr->err_ns + div_u64((u64)corr->drift_ns * abs(delta_us), corr->period_ms * 1000);
+	event->stc_err_ns = min_t(u64, err, U32_MAX);
+	mutex_unlock(&gpioDev->stc_lock);
+}
+
+/******************************************************************************
+ *
+ * ioctl
+ *
+ *****************************************************************************/
+
+static long test_gpio_ioctl_set_pull(struct test_gpio_dev *gpioDev, void __user *argp)
+{
+	struct test_gpio_pull pull;
+	int i;
+
+	if (copy_from_user(&pull, argp, sizeof(pull)))
+		return -EFAULT;
+
+	for (i = 0; i < 2; i++) {
+		if ((pull.up[i] & pull.down[i]) || (pull.up[i] & pull.off[i]) || (pull.down[i] & pull.off[i]))
+			return -EINVAL;
+	}
+	if ((pull.up[1] | pull.down[1] | pull.off[1]) & ~BANK1_PINS_MASK)
+		return -EINVAL;
+
+	// one clock sequence per pull state
+	set_pull_mask(gpioDev, pull.up[0], pull.up[1], PULL_UP);
+	set_pull_mask(gpioDev, pull.down[0], pull.down[1], PULL_DOWN);
+	set_pull_mask(gpioDev, pull.off[0], pull.off[1], PULL_OFF);
+
+	return 0;
+}
+
+/* Edge/level detect mode of several pins at once, using the same register images as
+ * the device tree configuration, so every register is written once. */
+static long test_gpio_ioctl_set_detect(struct test_gpio_dev *gpioDev, void __user *argp)
+{
+	/* enum edge_detect of every TEST_GPIO_DETECT_* mode, -1 for none */
+	static const int detect_modes[] = {
+		[TEST_GPIO_DETECT_NONE]			= -1,
+		[TEST_GPIO_DETECT_RISING]		= EDGE_RISING,
+		[TEST_GPIO_DETECT_FALLING]		= EGDE_FALLING,
+		[TEST_GPIO_DETECT_ASYNC_RISING]		= EDGE_ASYNC_RISING,
+		[TEST_GPIO_DETECT_ASYNC_FALLING]	= EDGE_ASYNC_FALLING,
+		[TEST_GPIO_DETECT_LEVEL_HIGH]		= LEVEL_HIGH,
+		[TEST_GPIO_DETECT_LEVEL_LOW]		= LEVEL_LOW,
+	};
+	struct test_gpio_detect detect;
+	struct test_gpio_image img;
+	int i, pin, edge;
+
+	if (copy_from_user(&detect, argp, sizeof(detect)))
+		return -EFAULT;
+
+	if (detect.mode >= ARRAY_SIZE(detect_modes) || (detect.mask[1] & ~BANK1_PINS_MASK))
+		return -EINVAL;
+	edge = detect_modes[detect.mode];
+
+	memset(&img, 0, sizeof(img));
+	for (i = 0; i < 2; i++) {
+		img.detect_mask[i] = detect.mask[i];
+		if (edge >= 0)
+			img.detect[edge][i] = detect.mask[i];
+	}
+	// as in enable_egde(), pin with edge detection is an input
+	if (edge >= 0) {
+		for (pin = 0; pin < NUM_GPIOS; pin++) {
+			if (detect.mask[pin / 32] & (0x1U << (pin % 32))) {
+				img.fsel_mask[pin / 10] |= (0x07 << GET_GPFSEL_PIN_OFFSET(pin));
+				img.fsel[pin / 10] |= (REG_FSEL_GPIO_IN << GET_GPFSEL_PIN_OFFSET(pin));
+			}
+		}
+	}
+
+	apply_image(gpioDev, &img);
+
+	return 0;
+}
+
+static long test_gpio_ioctl_get_event(struct test_gpio_dev *gpioDev, void __user *argp)
+{
+	struct test_gpio_event event;
+	int found;
+
+	mutex_lock(&gpioDev->event_lock);
+	found = kfifo_get(&gpioDev->events, &event);
+	mutex_unlock(&gpioDev->event_lock);
+	if (!found)
+		return -EAGAIN;
+
+	// event of a level detect pin is taken, so its next level event can be reported
+	rearm_level(gpioDev, event.pin);
+
+	if (event.flags & TEST_GPIO_EVENT_STC)
+		stc_to_mono(gpioDev, &event);
+
+	if (copy_to_user(argp, &event, sizeof(event)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long test_gpio_ioctl_get_stc_corr(struct test_gpio_dev *gpioDev, void __user *argp)
+{
+	struct test_gpio_stc_corr corr;
+
+	if (gpioDev->stc == NULL)
+		return -ENODEV;
+
+	mutex_lock(&gpioDev->stc_lock);
+	corr = gpioDev->stc_corr;
+	mutex_unlock(&gpioDev->stc_lock);
+
+	if (copy_to_user(argp, &corr, sizeof(corr)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long test_gpio_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct test_gpio_dev *gpioDev = container_of(file->private_data, struct test_gpio_dev, miscdev);
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case TEST_GPIO_IOC_SET_PULL:
+		return test_gpio_ioctl_set_pull(gpioDev, argp);
+	case TEST_GPIO_IOC_SET_DETECT:
+		return test_gpio_ioctl_set_detect(gpioDev, argp);
+	case TEST_GPIO_IOC_GET_EVENT:
+		return test_gpio_ioctl_get_event(gpioDev, argp);
+	case TEST_GPIO_IOC_GET_STC_CORR:
+		return test_gpio_ioctl_get_stc_corr(gpioDev, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Device file is readable (POLLIN) when there is an event to take with TEST_GPIO_IOC_GET_EVENT */
+static unsigned int test_gpio_poll(struct file *file, poll_table *wait)
+{
+	struct test_gpio_dev *gpioDev = container_of(file->private_data, struct test_gpio_dev, miscdev);
+
+	poll_wait(file, &gpioDev->event_wait, wait);
+
+	if (!kfifo_is_empty(&gpioDev->events))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+/******************************************************************************
+ *
+ * Parallel port
+ *
+ *****************************************************************************/
+
+/* Writes are posted, so before a delay the pins are read back, which makes sure
+ * the previous writes reached the GPIO block and the delay starts when the pins changed. */
+static void par_delay_ns(struct test_gpio_par *par, unsigned int ns)
+{
+	readl_relaxed(par->gpioDev->regs + GPLEV);
+	ndelay(ns);
+}
+
+/* Every word is put on the data pins with one GPCLR and one GPSET write per bank, while
+ * the strobe is at its idle level. After the setup time the strobe is pulsed in separate writes,
+ * so the word is stable on both edges of the pulse, and it is latched on the edge back to the idle level.
+ * Writes go to the same peripheral, so relaxed accessors keep them in order. */
+static void par_put_word(struct test_gpio_par *par, unsigned int set0, unsigned int set1)
+{
+	void __iomem *regs = par->gpioDev->regs;
+
+	writel_relaxed(par->mask[0] & ~set0, regs + GPCLR);
+	writel_relaxed(par->mask[1] & ~set1, regs + GPCLR + 4);
+	writel_relaxed(set0, regs + GPSET);
+	writel_relaxed(set1, regs + GPSET + 4);
+	if (par->strobe) {
+		if (par->setup_ns)
+			par_delay_ns(par, par->setup_ns);
+		writel_relaxed(par->strobe, regs + par->strobe_pulse);
+		if (par->pulse_ns)
+			par_delay_ns(par, par->pulse_ns);
+		writel_relaxed(par->strobe, regs + par->strobe_idle);
+	}
+	if (par->gap_us) {
+		readl_relaxed(regs + GPLEV);
+		udelay(par->gap_us);
+	}
+}
+
+static ssize_t test_gpio_par_write(struct file *file, const char __user *buf, size_t count, loff_t * ppos)
+{
+	struct test_gpio_par *par = container_of(file->private_data, struct test_gpio_par, miscdev);
+	unsigned char *kbuf;
+	unsigned int set0, set1;
+	size_t done = 0, chunk, i;
+	int b, err = 0;
+
+	/* Only whole words can be put on the port */
+	if (count % par->width)
+		return -EINVAL;
+
+	kbuf = kmalloc(PAR_CHUNK, GFP_KERNEL);
+	if (kbuf == NULL)
+		return -ENOMEM;
+
+	if (mutex_lock_interruptible(&par->lock)) {
+		kfree(kbuf);
+		return -ERESTARTSYS;
+	}
+
+	while (done < count) {
+		chunk = min_t(size_t, count - done, PAR_CHUNK);
+		if (copy_from_user(kbuf, buf + done, chunk)) {
+			err = -EFAULT;
+			break;
+		}
+
+		/* Words are little endian: the first byte drives par_pins[0]..par_pins[7] */
+		for (i = 0; i < chunk; i += par->width) {
+			set0 = 0;
+			set1 = 0;
+			for (b = 0; b < par->width; b++) {
+				set0 |= par->set[b][kbuf[i + b]][0];
+				set1 |= par->set[b][kbuf[i + b]][1];
+			}
+			par_put_word(par, set0, set1);
+		}
+		done += chunk;
+		// with par_gap_us a long buffer takes a while, let others run between chunks
+		cond_resched();
+	}
+
+	mutex_unlock(&par->lock);
+	kfree(kbuf);
+
+	if (done == 0 && err)
+		return err;
+	return done;
+}
+
+/* Precompute the per-byte scatter tables, configure data and strobe pins as outputs and
+ * register misc device for the port. The port is created only if "par_pins" module argument is given. */
+static int test_gpio_par_init(struct platform_device *pdev, struct test_gpio_dev *gpioDev, struct resource *regs)
+{
+	struct test_gpio_par *par;
+	unsigned int used[2] = {0, 0};
+	int i, b, v, pin, bit, err;
+
+	if (par_argc == 0)
+		return 0;
+
+	for (i = 0; i < par_argc; i++) {
+		if (par_pins[i] < 0 || par_pins[i] >= NUM_GPIOS || (used[par_pins[i] / 32] & (1U << (par_pins[i] % 32)))) {
+			dev_err(&pdev->dev, "invalid parallel port pin: %d\n", par_pins[i]);
+			return -EINVAL;
+		}
+		used[par_pins[i] / 32] |= (1U << (par_pins[i] % 32));
+	}
+	if (par_strobe >= NUM_GPIOS || (par_strobe >= 0 && (used[par_strobe / 32] & (1U << (par_strobe % 32))))) {
+		dev_err(&pdev->dev, "invalid parallel port strobe pin: %d\n", par_strobe);
+		return -EINVAL;
+	}
+
+	par = devm_kzalloc(&pdev->dev, sizeof(struct test_gpio_par), GFP_KERNEL);
+	if (par == NULL)
+		return -ENOMEM;
+
+	par->gpioDev = gpioDev;
+	mutex_init(&par->lock);
+	par->width = (par_argc + 7) / 8;
+	par->setup_ns = par_setup_ns;
+	par->pulse_ns = par_pulse_ns;
+	par->gap_us = par_gap_us;
+	par->mask[0] = used[0];
+	par->mask[1] = used[1];
+	if (par_strobe >= 0) {
+		par->strobe = (1U << (par_strobe % 32));
+		if (par_strobe_falling) {
+			par->strobe_pulse = GET_GPSET_REG_OFFSET(par_strobe);
+			par->strobe_idle = GET_GPCLR_REG_OFFSET(par_strobe);
+		} else {
+			par->strobe_pulse = GET_GPCLR_REG_OFFSET(par_strobe);
+			par->strobe_idle = GET_GPSET_REG_OFFSET(par_strobe);
+		}
+	}
+
+	for (b = 0; b < par->width; b++) {
+		for (v = 0; v < 256; v++) {
+			for (bit = 0; bit < 8 && (b * 8 + bit) < par_argc; bit++) {
+				if (!(v & (1 << bit)))
+					continue;
+				pin = par_pins[b * 8 + bit];
+				par->set[b][v][pin / 32] |= (1U << (pin % 32));
+			}
+		}
+	}
+
+	for (i = 0; i < par_argc; i++)
+		set_output(gpioDev, par_pins[i], OUTPUT_LOW);
+	// strobe starts at its idle level, the first word then gives a full pulse
+	if (par_strobe >= 0)
+		set_output(gpioDev, par_strobe, par_strobe_falling ? OUTPUT_LOW : OUTPUT_HIGH);
+
+	par->miscdev.fops = &test_gpio_par_fops;
+	par->miscdev.name = devm_kasprintf(&pdev->dev, GFP_KERNEL, "test_gpio_par-%x", regs->start);
+	par->miscdev.minor = MISC_DYNAMIC_MINOR;
+	err = misc_register(&par->miscdev);
+	if (err < 0)
+		return err;
+
+	gpioDev->par = par;
+
+	return 0;
+}
+
 /******************************************************************************
  *
  * sysfs show() and store()
@@ -485,6 +1198,9 @@ static ssize_t test_gpio_show(struct device *dev, struct device_attribute *attr,
 
 	pin = get_pin_nb(attr);
 
+	// value of the pin is read, so its next level event can be reported
+	rearm_level(gpioDev, pin);
+
 	reg_offset = GET_GPFSEL_REG_OFFSET(pin);
 	pin_offset = GET_GPFSEL_PIN_OFFSET(pin);
 
@@ -531,9 +1247,30 @@ static ssize_t test_gpio_store(struct device *dev, struct device_attribute *attr
 	else if (strncmp(buf, "falling", strlen("falling")) == 0) {
 		enable_egde(gpioDev, pin, EGDE_FALLING);
 	}
+	else if (strncmp(buf, "async-rising", strlen("async-rising")) == 0) {
+		enable_egde(gpioDev, pin, EDGE_ASYNC_RISING);
+	}
+	else if (strncmp(buf, "async-falling", strlen("async-falling")) == 0) {
+		enable_egde(gpioDev, pin, EDGE_ASYNC_FALLING);
+	}
+	else if (strncmp(buf, "level-high", strlen("level-high")) == 0) {
+		enable_egde(gpioDev, pin, LEVEL_HIGH);
+	}
+	else if (strncmp(buf, "level-low", strlen("level-low")) == 0) {
+		enable_egde(gpioDev, pin, LEVEL_LOW);
+	}
 	else if (strncmp(buf, "none", strlen("none")) == 0) {
 		disable_egdes(gpioDev, pin);
 	}
+	else if (strncmp(buf, "pullup", strlen("pullup")) == 0) {
+		set_pull(gpioDev, pin, PULL_UP);
+	}
+	else if (strncmp(buf, "pulldown", strlen("pulldown")) == 0) {
+		set_pull(gpioDev, pin, PULL_DOWN);
+	}
+	else if (strncmp(buf, "pulloff", strlen("pulloff")) == 0) {
+		set_pull(gpioDev, pin, PULL_OFF);
+	}
 	else {
 		printk(KERN_ALERT "\nERROR: Invalid command: %s\n", buf);
 		//TODO: handle this error
@@ -550,32 +1287,269 @@ static struct of_device_id test_gpio_dt_match[] = {
 MODULE_DEVICE_TABLE(of, test_gpio_dt_match);
 #endif
 
+/* Wake up poll()/select() waiters on the sysfs files of pins which had an event */
+static void test_gpio_notify_work(struct work_struct *work)
+{
+	struct test_gpio_dev *gpioDev = container_of(work, struct test_gpio_dev, notify_work);
+	int pin;
+
+	for (pin = 0; pin < NUM_GPIOS; pin++) {
+		if (test_and_clear_bit(pin, gpioDev->notify_pending))
+			sysfs_notify(&gpioDev->dev->kobj, NULL, gpioDev->pin_sysfile[pin]);
+	}
+}
+
 static irqreturn_t test_gpio_interrupt(int irq, void *dev)
 {
-	int ret = IRQ_HANDLED;
 	int pin;
 	struct test_gpio_dev *gpioDev = (struct test_gpio_dev *)dev;
+	struct test_gpio_event event = { 0 };
+	unsigned int pending[2];
+	u32 stc_lo = 0;
+
+	/* Latch the system timer first, so the timestamp is as close to the edge as possible */
+	if (gpioDev->stc)
+		stc_lo = readl_relaxed(gpioDev->stc + ST_CLO);
+	event.ktime_ns = ktime_get_ns();
+
+	// both GPEDS0 and GPEDS1 are zeros of all bits, e.g. the event was handled by the other registration
+	if (!acknowledge_int(gpioDev, pending))
+		return IRQ_NONE;
+
+	/* All pins pending now share the same timestamp, near simultaneous edges are not delayed
+	 * by handling of each other */
+	if (gpioDev->stc) {
+		event.stc = stc_extend(gpioDev, stc_lo);
+		event.flags |= TEST_GPIO_EVENT_STC;
+	}
 
-	pin = acknowledge_int(gpioDev);
-	//pin=64: both GPEDS0 and GPEDS1 are zeros of all bits!!
-	if (pin < 64)
-		pr_info("\nEnter test_gpio_interrupt: %s, pin: %d\n", gpioDev->miscdev.name, pin);
+	for (pin = 0; pin < NUM_GPIOS; pin++) {
+		if (!(pending[pin / 32] & (0x1U << (pin % 32))))
+			continue;
+
+		dev_dbg(gpioDev->dev, "test_gpio_interrupt: %s, pin: %d\n", gpioDev->miscdev.name, pin);
+
+		event.pin = pin;
+		event.flags &= ~TEST_GPIO_EVENT_OVERFLOW;
+		if (gpioDev->events_lost)
+			event.flags |= TEST_GPIO_EVENT_OVERFLOW;
+		gpioDev->events_lost = !kfifo_put(&gpioDev->events, event);
+
+		if (gpioDev->pin_sysfile[pin]) {
+			set_bit(pin, gpioDev->notify_pending);
+			schedule_work(&gpioDev->notify_work);
+		}
+	}
+	wake_up_interruptible(&gpioDev->event_wait);
 
-	return ret;
+	return IRQ_HANDLED;
 }
 
-static int test_gpio_remove(struct platform_device *pdev)
+/******************************************************************************
+ *
+ * Initial pin configuration from the device tree
+ *
+ *****************************************************************************/
+
+/* Every available child node of the test_gpio node describes one pin, e.g:
+ *	led_red {
+ *		pin = <17>;
+ *		direction = "out";	// "in" or "out"
+ *		level = "high";		// "high" or "low", initial level of the output
+ *		edge = "rising";	// "rising", "falling", "async-rising", "async-falling",
+ *					// "level-high", "level-low" or "none", pin becomes input
+ *		pull = "up";		// "up", "down" or "off"
+ *	};
+ * All properties but pin are optional, what is not described is left as it is.
+ * level is only valid for an output, and edge other than "none" only for an input.
+ * Returns the pin number or negative error.
+ */
+static int test_gpio_parse_pin(struct device *dev, struct device_node *np, struct test_gpio_image *img)
+{
+	static const char * const directions[] = { "in", "out" };
+	static const char * const levels[] = { [OUTPUT_LOW] = "low", [OUTPUT_HIGH] = "high" };
+	static const char * const edges[] = {
+		[EDGE_RISING] = "rising", [EGDE_FALLING] = "falling",
+		[EDGE_ASYNC_RISING] = "async-rising", [EDGE_ASYNC_FALLING] = "async-falling",
+		[LEVEL_HIGH] = "level-high", [LEVEL_LOW] = "level-low"
+	};
+	static const char * const pulls[] = { [PULL_OFF] = "off", [PULL_DOWN] = "down", [PULL_UP] = "up" };
+	const char *str;
+	u32 pin;
+	unsigned int bit;
+	int bank, fsel = -1, val;
+
+	if (of_property_read_u32(np, "pin", &pin) || pin >= NUM_GPIOS) {
+		dev_err(dev, "%s: missing or invalid pin\n", np->name);
+		return -EINVAL;
+	}
+	bank = pin / 32;
+	bit = (0x1U << (pin % 32));
+
+	if (of_property_read_string(np, "direction", &str) == 0) {
+		val = match_string(directions, ARRAY_SIZE(directions), str);
+		if (val < 0)
+			goto out_invalid;
+		fsel = val ? REG_FSEL_GPIO_OUT : REG_FSEL_GPIO_IN;
+	}
+
+	if (of_property_read_string(np, "level", &str) == 0) {
+		val = match_string(levels, ARRAY_SIZE(levels), str);
+		if (val < 0)
+			goto out_invalid;
+		if (fsel == REG_FSEL_GPIO_IN) {
+			dev_err(dev, "%s: level is set for input pin\n", np->name);
+			return -EINVAL;
+		}
+		if (val == OUTPUT_HIGH)
+			img->set[bank] |= bit;
+		else
+			img->clr[bank] |= bit;
+		fsel = REG_FSEL_GPIO_OUT;
+	}
+
+	if (of_property_read_string(np, "edge", &str) == 0) {
+		img->detect_mask[bank] |= bit;
+		if (strcmp(str, "none") != 0) {
+			val = match_string(edges, ARRAY_SIZE(edges), str);
+			if (val < 0)
+				goto out_invalid;
+			// as in enable_egde(), pin with edge detection is an input
+			if (fsel == REG_FSEL_GPIO_OUT) {
+				dev_err(dev, "%s: edge is set for output pin\n", np->name);
+				return -EINVAL;
+			}
+			img->detect[val][bank] |= bit;
+			fsel = REG_FSEL_GPIO_IN;
+		}
+	}
+
+	if (of_property_read_string(np, "pull", &str) == 0) {
+		val = match_string(pulls, ARRAY_SIZE(pulls), str);
+		if (val < 0)
+			goto out_invalid;
+		img->pull[val][bank] |= bit;
+	}
+
+	if (fsel >= 0) {
+		img->fsel_mask[pin / 10] |= (0x07 << GET_GPFSEL_PIN_OFFSET(pin));
+		img->fsel[pin / 10] |= (fsel << GET_GPFSEL_PIN_OFFSET(pin));
+	}
+
+	return pin;
+
+out_invalid:
+	dev_err(dev, "%s: invalid value \"%s\"\n", np->name, str);
+	return -EINVAL;
+}
+
+/* Write the register images, every register only once:
+ * pulls first, then output levels before the pins become outputs, so they do not glitch,
+ * then function select, and edge detection with stale events cleared at last. */
+static void apply_image(struct test_gpio_dev *gpioDev, struct test_gpio_image *img)
+{
+	int i, e, val;
+	unsigned long flags;
+
+	for (i = PULL_OFF; i <= PULL_UP; i++)
+		set_pull_mask(gpioDev, img->pull[i][0], img->pull[i][1], i);
+
+	for (i = 0; i < 2; i++) {
+		if (img->clr[i])
+			reg_write(gpioDev, img->clr[i], GPCLR + i * 4);
+		if (img->set[i])
+			reg_write(gpioDev, img->set[i], GPSET + i * 4);
+	}
+
+	for (i = 0; i < 6; i++) {
+		if (img->fsel_mask[i] == 0)
+			continue;
+		val = reg_read(gpioDev, GPFSEL + i * 4) & ~img->fsel_mask[i];
+		reg_write(gpioDev, val | img->fsel[i], GPFSEL + i * 4);
+	}
+
+	spin_lock_irqsave(&gpioDev->detect_lock, flags);
+	for (i = 0; i < 2; i++) {
+		if (img->detect_mask[i] == 0)
+			continue;
+		// events detected before the new configuration are of no interest
+		reg_write(gpioDev, img->detect_mask[i], GPEDS + i * 4);
+		for (e = 0; e < EDGE_MAX; e++) {
+			val = reg_read(gpioDev, edge_reg[e] + i * 4) & ~img->detect_mask[i];
+			reg_write(gpioDev, val | img->detect[e][i], edge_reg[e] + i * 4);
+		}
+		gpioDev->level_masked[0][i] &= ~img->detect_mask[i];
+		gpioDev->level_masked[1][i] &= ~img->detect_mask[i];
+	}
+	spin_unlock_irqrestore(&gpioDev->detect_lock, flags);
+}
+
+/* Build the register images from all pin nodes and apply them.
+ * Pins described in the device tree are stored in pins[], for their sysfs entries.
+ * Returns the number of described pins or negative error. */
+static int test_gpio_of_init(struct platform_device *pdev, struct test_gpio_dev *gpioDev, int *pins)
+{
+	struct device_node *child;
+	struct test_gpio_image *img;
+	unsigned int seen[2] = {0, 0};
+	int pin, num = 0;
+
+	if (pdev->dev.of_node == NULL || of_get_available_child_count(pdev->dev.of_node) == 0)
+		return 0;
+
+	img = kzalloc(sizeof(struct test_gpio_image), GFP_KERNEL);
+	if (img == NULL)
+		return -ENOMEM;
+
+	for_each_available_child_of_node(pdev->dev.of_node, child) {
+		pin = test_gpio_parse_pin(&pdev->dev, child, img);
+		if (pin >= 0 && (seen[pin / 32] & (0x1U << (pin % 32)))) {
+			dev_err(&pdev->dev, "%s: pin %d is already described\n", child->name, pin);
+			pin = -EINVAL;
+		}
+		if (pin < 0) {
+			of_node_put(child);
+			kfree(img);
+			return pin;
+		}
+		seen[pin / 32] |= (0x1U << (pin % 32));
+		pins[num++] = pin;
+	}
+
+	apply_image(gpioDev, img);
+	kfree(img);
+
+	return num;
+}
+
+static void test_gpio_remove_sysfiles(struct platform_device *pdev, struct test_gpio_dev *gpioDev)
 {
 	int i;
-	struct test_gpio_dev *gpioDev = platform_get_drvdata(pdev);
 
-	for (i = 0; i < gpio_argc; i++) {
+	for (i = 0; i < gpioDev->num_sysfiles; i++) {
 //		pr_info("device_remove_file: %s\n", gpioDev->dev_attr[i]->attr.name);
 		device_remove_file(&pdev->dev, gpioDev->dev_attr[i]);
 	}
+}
 
-	misc_deregister(&gpioDev->miscdev);
+static int test_gpio_remove(struct platform_device *pdev)
+{
+	struct test_gpio_dev *gpioDev = platform_get_drvdata(pdev);
+
+	/* No more interrupts may queue the notify work once it is cancelled */
+	if (gpioDev->irq) {
+		free_irq(gpioDev->irq, gpioDev);
+		devm_free_irq(&pdev->dev, gpioDev->irq, gpioDev);
+	}
+	cancel_work_sync(&gpioDev->notify_work);
+	if (gpioDev->stc)
+		cancel_delayed_work_sync(&gpioDev->stc_work);
 
+	test_gpio_remove_sysfiles(pdev, gpioDev);
+
+	misc_deregister(&gpioDev->miscdev);
+	if (gpioDev->par)
+		misc_deregister(&gpioDev->par->miscdev);
 
 	return 0;
 }
@@ -583,11 +1557,12 @@ static int test_gpio_remove(struct platform_device *pdev)
 static int test_gpio_probe(struct platform_device *pdev)
 {
 	const struct of_device_id *match;
-	struct resource *regs;
+	struct resource *regs, *stc_regs;
 	struct test_gpio_dev *gpioDev;
 	int err = 0, i;
 	char name[20];
 	int irq;
+	int pins[NUM_GPIOS], num_pins;
 
 	/* The first operation is a sanity check, verifying that the probe was called on a device that is relevant.
 	 * This is probably not really necessary, but this check appears in many drivers. */
@@ -606,7 +1581,15 @@ static int test_gpio_probe(struct platform_device *pdev)
 //		pr_info("\n~~~~~ regs->name: %s\n", regs->name); //~~~~~ regs->name: /soc/test_gpio@7e215000
 
 	gpioDev = devm_kzalloc(&pdev->dev, sizeof(struct test_gpio_dev), GFP_KERNEL);
-
+	gpioDev->dev = &pdev->dev;
+	mutex_init(&gpioDev->pull_lock);
+	spin_lock_init(&gpioDev->detect_lock);
+	INIT_KFIFO(gpioDev->events);
+	mutex_init(&gpioDev->event_lock);
+	init_waitqueue_head(&gpioDev->event_wait);
+	mutex_init(&gpioDev->stc_lock);
+	INIT_DELAYED_WORK(&gpioDev->stc_work, test_gpio_stc_work);
+	INIT_WORK(&gpioDev->notify_work, test_gpio_notify_work);
 
 
 	/* map the device physical memory into the virtual address space  */
@@ -661,15 +1644,27 @@ static int test_gpio_probe(struct platform_device *pdev)
 	}
 //	pr_info("\nvirtual address: 0x%x!!!\n", (int)gpioDev->regs); //virtual address: 0xf2200000
 
-	/* Create sysfs entries for all pins passed as module arguments */
+	/* Apply initial configuration of pins described in the device tree */
+	num_pins = test_gpio_of_init(pdev, gpioDev, pins);
+	if (num_pins < 0)
+		return num_pins;
+
+	/* Create sysfs entries for all pins described in the device tree,
+	 * or if there are none, for all pins passed as module arguments */
+	if (num_pins == 0) {
+		for (i = 0; i < gpio_argc; i++) {
+			if (gpio[i] >= 0 && gpio[i] < NUM_GPIOS)
+				pins[num_pins++] = gpio[i];
+		}
+	}
 	//static DEVICE_ATTR(testgpio, S_IWUSR | S_IRUGO, test_gpio_show, test_gpio_store);
-	if (gpio_argc > 0) {
+	if (num_pins > 0) {
 		// dinamically allocated array of device_attribute structs
-		gpioDev->dev_attr = devm_kzalloc(&pdev->dev, gpio_argc * sizeof(struct device_attribute), GFP_ATOMIC);
+		gpioDev->dev_attr = devm_kzalloc(&pdev->dev, num_pins * sizeof(struct device_attribute), GFP_ATOMIC);
 		// dinamically allocated array of sysfs entry names
-		gpioDev->sysfiles = devm_kzalloc(&pdev->dev, gpio_argc * sizeof(gpioDev->sysfiles), GFP_ATOMIC);
-		for (i = 0; i < gpio_argc; i++) {
-			snprintf(name, sizeof(name), "testgpio%d", gpio[i]);
+		gpioDev->sysfiles = devm_kzalloc(&pdev->dev, num_pins * sizeof(gpioDev->sysfiles), GFP_ATOMIC);
+		for (i = 0; i < num_pins; i++) {
+			snprintf(name, sizeof(name), "testgpio%d", pins[i]);
 	//		gpioDev->dev_attr[i] = __ATTR(testgpio, S_IWUSR | S_IRUGO, test_gpio_show, test_gpio_store);
 			gpioDev->sysfiles[i] = devm_kzalloc(&pdev->dev, strlen(name)+1, GFP_ATOMIC);
 			strcpy(gpioDev->sysfiles[i], name);
@@ -680,7 +1675,9 @@ static int test_gpio_probe(struct platform_device *pdev)
 			gpioDev->dev_attr[i]->show	= test_gpio_show;
 			gpioDev->dev_attr[i]->store	= test_gpio_store;
 			device_create_file(&pdev->dev, gpioDev->dev_attr[i]);
+			gpioDev->pin_sysfile[pins[i]] = gpioDev->sysfiles[i];
 		}
+		gpioDev->num_sysfiles = num_pins;
 	}
 
 	/* IMPLEMENTATION OF CHARACTER DRIVER USING MISC FRAMEWORK
@@ -701,7 +1698,14 @@ static int test_gpio_probe(struct platform_device *pdev)
 	gpioDev->miscdev.minor = MISC_DYNAMIC_MINOR;
 	err = misc_register(&gpioDev->miscdev);
 	if (err < 0)
-		return err;
+		goto out_sysfs_error;
+
+	/* Parallel port gets its own misc device, so write() on it can stream raw words */
+	err = test_gpio_par_init(pdev, gpioDev, regs);
+	if (err < 0) {
+		misc_deregister(&gpioDev->miscdev);
+		goto out_sysfs_error;
+	}
 
 	/* In order to deal with usual constraint of handling multiple devices, miscdev struct is added to our driver specifc private data structure.
 	 * To be able to access our private data structure in other parts of the driver, dev struct is attached to the pdev structure using the
@@ -709,6 +1713,21 @@ static int test_gpio_probe(struct platform_device *pdev)
 	 */
 	platform_set_drvdata(pdev, gpioDev);
 
+	/* Optional system timer for event timestamps. It is used by the kernel timer driver as well,
+	 * so as for the GPIO registers, the range is only remapped, not requested. */
+	stc_regs = platform_get_resource(pdev, IORESOURCE_MEM, 1);
+	if (stc_regs) {
+		gpioDev->stc = devm_ioremap(&pdev->dev, stc_regs->start, resource_size(stc_regs));
+		if (gpioDev->stc == NULL) {
+			dev_err(&pdev->dev, "failed to ioremap() system timer\n");
+			err = -ENODEV;
+			goto out_irq_error;
+		}
+		stc_correlate(gpioDev);
+		schedule_delayed_work(&gpioDev->stc_work, msecs_to_jiffies(STC_CORR_PERIOD_MS));
+	}
+
+
 
 
 	/*  device tree:
@@ -724,7 +1743,8 @@ static int test_gpio_probe(struct platform_device *pdev)
 	irq = platform_get_irq(pdev, 0);
 	if (irq < 0) {
 		dev_err(&pdev->dev, "could not get IRQ\n");
-		return irq;
+		err = irq;
+		goto out_irq_error;
 	}
 //	pr_info("\nIRQ number index: %d\n", irq);
 
@@ -740,6 +1760,7 @@ static int test_gpio_probe(struct platform_device *pdev)
 	err = devm_request_irq(&pdev->dev, irq, test_gpio_interrupt, IRQF_SHARED, "test_gpio_int", gpioDev);
 	if (err) {
 		dev_err(&pdev->dev, "devm_request_irq error: %d\n", err);
+		free_irq(irq, gpioDev);
 		goto out_irq_error;
 	}
 
@@ -766,6 +1787,11 @@ static int test_gpio_probe(struct platform_device *pdev)
 	out_irq_error:
 		test_gpio_remove(pdev);
 		return err;
+
+	/* sysfs entries point into devm memory, which is freed when probe fails */
+	out_sysfs_error:
+		test_gpio_remove_sysfiles(pdev, gpioDev);
+		return err;
 }
 
 
@@ -0,0 +1,80 @@
+/* Userspace interface of the test_gpio module (ioctl on /dev/test_gpio-XXXXXXXX)
+ *
+ * Pins are passed as bitmasks of two 32-bit words, as in the GPIO registers:
+ * bit n of [0] is GPIO n, bit n of [1] is GPIO 32 + n. */
+#ifndef _TEST_GPIO_H
+#define _TEST_GPIO_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define TEST_GPIO_IOC_MAGIC	'G'
+
+/* Pull-up/down resistors of several pins at once.
+ * All pins with the same pull state are clocked by a single GPPUD/GPPUDCLK sequence,
+ * so at most three sequences are done per call. A pin must not be in more than one mask. */
+struct test_gpio_pull {
+	__u32 up[2];
+	__u32 down[2];
+	__u32 off[2];
+};
+
+#define TEST_GPIO_IOC_SET_PULL	_IOW(TEST_GPIO_IOC_MAGIC, 1, struct test_gpio_pull)
+
+/* Edge/level detect modes */
+#define TEST_GPIO_DETECT_NONE		0
+#define TEST_GPIO_DETECT_RISING		1	/* synchronous, sampled by the system clock */
+#define TEST_GPIO_DETECT_FALLING	2
+#define TEST_GPIO_DETECT_ASYNC_RISING	3	/* asynchronous, catches pulses shorter than a clock */
+#define TEST_GPIO_DETECT_ASYNC_FALLING	4
+#define TEST_GPIO_DETECT_LEVEL_HIGH	5	/* one event, re-armed when the pin value is read
+						 * or its event is taken with TEST_GPIO_IOC_GET_EVENT */
+#define TEST_GPIO_DETECT_LEVEL_LOW	6
+
+/* Set detect mode of all pins in mask, pins with detection enabled become inputs */
+struct test_gpio_detect {
+	__u32 mask[2];
+	__u32 mode;
+};
+
+#define TEST_GPIO_IOC_SET_DETECT	_IOW(TEST_GPIO_IOC_MAGIC, 2, struct test_gpio_detect)
+
+/* Edge/level event, taken from the event queue with TEST_GPIO_IOC_GET_EVENT.
+ * stc is the BCM2835 free-running system timer (1 MHz), latched as the first thing in the
+ * interrupt handler, so unlike ktime_ns it does not include the interrupt entry latency.
+ * Events of all pins pending in the same interrupt have the same stc and ktime_ns.
+ * stc_ns is stc converted to CLOCK_MONOTONIC with the latest correlation, with estimated error stc_err_ns.
+ * stc fields are valid only with TEST_GPIO_EVENT_STC flag, i.e. if the system timer is in the device tree. */
+struct test_gpio_event {
+	__u32 pin;
+	__u32 flags;
+	__u64 ktime_ns;		/* CLOCK_MONOTONIC, taken in the interrupt handler */
+	__u64 stc;		/* system timer counter, in microseconds */
+	__u64 stc_ns;		/* stc as CLOCK_MONOTONIC */
+	__u32 stc_err_ns;	/* estimated error of stc_ns */
+	__u32 reserved;
+};
+
+#define TEST_GPIO_EVENT_STC		(1 << 0)	/* stc fields are valid */
+#define TEST_GPIO_EVENT_OVERFLOW	(1 << 1)	/* events were lost before this one, queue was full */
+
+/* Correlation of the system timer to CLOCK_MONOTONIC, refreshed every period_ms.
+ * mono_ns is CLOCK_MONOTONIC when the counter was stc, within err_ns.
+ * drift_ns is how far CLOCK_MONOTONIC predicted from the previous correlation was
+ * from the measured one, over the last period. */
+struct test_gpio_stc_corr {
+	__u64 stc;
+	__u64 mono_ns;
+	__u32 err_ns;
+	__u32 drift_ns;
+	__u32 period_ms;
+	__u32 reserved;
+};
+
+/* Take the oldest event from the queue, fails with EAGAIN if it is empty.
+ * poll() on the device file reports POLLIN while the queue is not empty. */
+#define TEST_GPIO_IOC_GET_EVENT		_IOR(TEST_GPIO_IOC_MAGIC, 3, struct test_gpio_event)
+/* Get the latest correlation, fails with ENODEV if system timer is not in the device tree */
+#define TEST_GPIO_IOC_GET_STC_CORR	_IOR(TEST_GPIO_IOC_MAGIC, 4, struct test_gpio_stc_corr)
+
+#endif /* _TEST_GPIO_H */